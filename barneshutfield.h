@@ -0,0 +1,240 @@
+#ifndef BARNESHUTFIELD_H
+#define BARNESHUTFIELD_H
+#include <QDebug>
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+
+#include <emmintrin.h>
+
+#include "inlinemath.h"
+#include "potentialfield.h"
+#include "scalarfield.h"
+
+using namespace inlinemath;
+
+// Barnes-Hut approximation of a PotentialField.
+//
+// prepare() sorts the charges into an octree where each cell also holds an aggregate
+// charge: the sum of its charges placed at their barycenter (weighted by |value|).
+// A cell of edge s seen from a distance d with s < theta * d is evaluated as its
+// aggregate instead of being opened, so a sample costs O(log N) charges instead of N.
+// With same sign charges the dipole term of the aggregate cancels and the relative
+// error of each aggregated cell is of the order of theta^2. theta = 0 is exact.
+class BarnesHutField : public ScalarField<BarnesHutField> {
+public:
+    BarnesHutField(const PotentialField &source, float theta = 0.5f) : source_(source) {
+        setTheta(theta);
+    }
+
+    virtual ~BarnesHutField() {}
+
+    void setTheta(float theta) {
+        theta_ = theta;
+    }
+
+    float theta() const {
+        return theta_;
+    }
+
+    // rebuild the tree from the current charges of the source
+    void prepare() const {
+        nodes_.clear();
+        charges_ = source_;
+        int count = charges_.size();
+        if (count == 0) {
+            return;
+        }
+
+        // bounding cube
+        Vector3D first = charges_[0].pos();
+        float minX = first.x(), minY = first.y(), minZ = first.z();
+        float maxX = minX, maxY = minY, maxZ = minZ;
+        for (int i = 1; i < count; i++) {
+            Vector3D p = charges_[i].pos();
+            minX = qMin(minX, p.x()); maxX = qMax(maxX, p.x());
+            minY = qMin(minY, p.y()); maxY = qMax(maxY, p.y());
+            minZ = qMin(minZ, p.z()); maxZ = qMax(maxZ, p.z());
+        }
+        float half = qMax(qMax(maxX - minX, maxY - minY), maxZ - minZ) / 2.0f + 1e-3f;
+        Vector3D center((minX + maxX) / 2.0f, (minY + maxY) / 2.0f, (minZ + maxZ) / 2.0f);
+
+        scratch_.resize(count);
+        nodes_.append(Node());
+        build(0, 0, count, center, half, 0);
+    }
+
+    inline float fieldAt(const Vector3D &pos, Vector3D &gradient) const {
+        float value = 0.0;
+        Vector3D g, lg;
+        const Node *nodes = nodes_.constData();
+        const Charge *charges = charges_.constData();
+        float theta2 = theta_ * theta_;
+
+        int stack[StackSize];
+        int top = 0;
+        if (!nodes_.isEmpty()) {
+            stack[top++] = 0;
+        }
+        while (top > 0) {
+            const Node &node = nodes[stack[--top]];
+            if (node.leaf) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    value += charges[i].fieldAt(pos, lg);
+                    g += lg;
+                }
+                continue;
+            }
+
+            Vector3D disp = pos - node.aggregate.pos();
+            if (node.size2 < theta2 * disp.lengthSquared()) {
+                value += node.aggregate.fieldAt(pos, lg);
+                g += lg;
+            }
+            else {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    stack[top++] = i;
+                }
+            }
+        }
+        gradient = g;
+        return value;
+    }
+
+    // a cell is aggregated only if it is distant enough from all 4 positions
+    inline __m128 fieldAt4(const Vector3D4 &pos, Vector3D4 &gradient) const {
+        __m128 value = _mm_setzero_ps();
+        Vector3D4 g, lg;
+        const Node *nodes = nodes_.constData();
+        const Charge *charges = charges_.constData();
+        __m128 theta2 = _mm_set1_ps(theta_ * theta_);
+
+        int stack[StackSize];
+        int top = 0;
+        if (!nodes_.isEmpty()) {
+            stack[top++] = 0;
+        }
+        while (top > 0) {
+            const Node &node = nodes[stack[--top]];
+            if (node.leaf) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    value = _mm_add_ps(value, charges[i].fieldAt4(pos, lg));
+                    g += lg;
+                }
+                continue;
+            }
+
+            __m128 distance2 = (pos - Vector3D4(node.aggregate.pos())).lengthSquared();
+            __m128 distant = _mm_cmplt_ps(_mm_set1_ps(node.size2), _mm_mul_ps(theta2, distance2));
+            if (_mm_movemask_ps(distant) == 0xf) {
+                value = _mm_add_ps(value, node.aggregate.fieldAt4(pos, lg));
+                g += lg;
+            }
+            else {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    stack[top++] = i;
+                }
+            }
+        }
+        gradient = g;
+        return value;
+    }
+
+private:
+    static constexpr int LeafSize = 4;      // cells with this many charges or less are summed exactly
+    static constexpr int MaxDepth = 16;     // stops splitting coincident charges
+    static constexpr int StackSize = MaxDepth * 7 + 8;
+
+    struct Node {
+        Charge aggregate;   // sum of the charges at their barycenter
+        float size2;        // squared edge length of the cell
+        int first;          // first child in nodes_, first charge in charges_ for leaves
+        int count;          // number of children, or of charges for leaves
+        bool leaf;
+    };
+
+    const PotentialField &source_;
+    float theta_;
+
+    // rebuilt by prepare(), read only while rendering
+    mutable QVector<Node> nodes_;
+    mutable QVector<Charge> charges_;   // source charges, grouped by leaf
+    mutable QVector<Charge> scratch_;
+
+    // fill node with the charges in [begin, end) that lie in the cube (center, half)
+    void build(int node, int begin, int end, const Vector3D &center, float half, int depth) const {
+        float value = 0.0f, weight = 0.0f;
+        Vector3D barycenter;
+        for (int i = begin; i < end; i++) {
+            const Charge &c = charges_[i];
+            float w = std::abs(c.value());
+            value += c.value();
+            weight += w;
+            barycenter += w * c.pos();
+        }
+        if (weight > 0.0f) {
+            barycenter /= weight;
+        }
+        else {
+            barycenter = center;
+        }
+
+        Node &n = nodes_[node];
+        n.aggregate = Charge(barycenter, value);
+        n.size2 = 4.0f * half * half;
+
+        if (end - begin <= LeafSize || depth == MaxDepth) {
+            n.leaf = true;
+            n.first = begin;
+            n.count = end - begin;
+            return;
+        }
+
+        // counting sort of the charges by octant
+        int octantCount[8] = { 0 };
+        int octantStart[8];
+        Vector3D c = center;
+        float cx = c.x(), cy = c.y(), cz = c.z();
+        auto octant = [&](const Charge &charge) {
+            Vector3D p = charge.pos();
+            return (p.x() > cx ? 1 : 0) | (p.y() > cy ? 2 : 0) | (p.z() > cz ? 4 : 0);
+        };
+        for (int i = begin; i < end; i++) {
+            octantCount[octant(charges_[i])]++;
+        }
+        int children = 0;
+        for (int o = 0, start = begin; o < 8; o++) {
+            octantStart[o] = start;
+            start += octantCount[o];
+            if (octantCount[o]) {
+                children++;
+            }
+        }
+        int fill[8];
+        std::copy(octantStart, octantStart + 8, fill);
+        for (int i = begin; i < end; i++) {
+            scratch_[fill[octant(charges_[i])]++] = charges_[i];
+        }
+        std::copy(scratch_.constBegin() + begin, scratch_.constBegin() + end, charges_.begin() + begin);
+
+        // children are contiguous, n is invalidated by the appends
+        int firstChild = nodes_.size();
+        n.leaf = false;
+        n.first = firstChild;
+        n.count = children;
+        nodes_.resize(firstChild + children);
+
+        float quarter = half / 2.0f;
+        for (int o = 0, child = firstChild; o < 8; o++) {
+            if (octantCount[o] == 0)
+                continue;
+            Vector3D childCenter(cx + ((o & 1) ? quarter : -quarter),
+                                 cy + ((o & 2) ? quarter : -quarter),
+                                 cz + ((o & 4) ? quarter : -quarter));
+            build(child++, octantStart[o], octantStart[o] + octantCount[o], childCenter, quarter, depth + 1);
+        }
+    }
+};
+
+#endif // BARNESHUTFIELD_H
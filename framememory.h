@@ -0,0 +1,163 @@
+#ifndef FRAMEMEMORY_H
+#define FRAMEMEMORY_H
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include <new>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// NUMA nodes of the machine and the cpus they hold, read once from sysfs.
+// Machines without sysfs, with a single node, or when disabled with setEnabled(false)
+// are seen as one node and threads are never pinned.
+class NumaTopology {
+public:
+    static const NumaTopology &instance() {
+        static NumaTopology topology;
+        return topology;
+    }
+
+    // call before creating any renderer
+    static void setEnabled(bool enable) {
+        enabled() = enable;
+    }
+
+    int nodeCount() const {
+        return enabled() ? cpus_.size() : 1;
+    }
+
+    // workers are spread on nodes in contiguous blocks
+    int nodeOfWorker(int thread, int threadCount) const {
+        return thread * nodeCount() / threadCount;
+    }
+
+    // restrict the calling thread to the cpus of node, no-op on a single node
+    void pinCurrentThread(int node) const {
+        if (nodeCount() < 2)
+            return;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus_[node]) {
+            CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+            qWarning() << __func__ << "cannot pin thread to node" << node;
+        }
+    }
+
+private:
+    QVector<QVector<int>> cpus_;
+
+    NumaTopology() {
+        QDir dir("/sys/devices/system/node");
+        QStringList nodes = dir.entryList(QStringList("node*"), QDir::Dirs);
+        for (const QString &node : nodes) {
+            QFile file(dir.filePath(node + "/cpulist"));
+            if (!file.open(QIODevice::ReadOnly))
+                continue;
+
+            // "0-3,8-11"
+            QVector<int> cpus;
+            for (const QString &range : QString(file.readAll()).trimmed().split(',')) {
+                if (range.isEmpty())
+                    continue;
+
+                QStringList bounds = range.split('-');
+                int first = bounds.first().toInt();
+                int last = bounds.last().toInt();
+                for (int cpu = first; cpu <= last; cpu++) {
+                    cpus << cpu;
+                }
+            }
+            if (!cpus.isEmpty()) {
+                cpus_ << cpus;
+            }
+        }
+
+        // no sysfs, one node with whatever cpus
+        if (cpus_.isEmpty()) {
+            cpus_ << QVector<int>();
+        }
+
+        qDebug() << __func__ << cpus_.size() << "nodes";
+    }
+
+    static bool &enabled() {
+        static bool enabled = true;
+        return enabled;
+    }
+};
+
+
+// Anonymous memory for frame sized buffers (rays, pixels).
+// Pages are not touched here so that, on NUMA machines, each lands on the node of the
+// thread that first writes it: renderers have each line written first by a worker of
+// the node that keeps rendering it. Buffers of HugePageSize or more are aligned on
+// HugePageSize and advised to use transparent huge pages to save TLB misses.
+// Throws std::bad_alloc like new when out of memory.
+class FrameMemory {
+public:
+    static constexpr size_t HugePageSize = 2 << 20;
+
+    explicit FrameMemory(size_t size) : size_(size) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t alignment = size >= HugePageSize ? HugePageSize : page;
+        length_ = roundUp(qMax(size, (size_t) 1), alignment);
+
+        // over allocate to align the start, then give back what is around
+        size_t mapped = length_ + alignment - page;
+        void *mapping = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+
+        uchar *start = static_cast<uchar *>(mapping);
+        data_ = reinterpret_cast<uchar *>(roundUp((quintptr) start, alignment));
+        if (data_ > start) {
+            munmap(start, data_ - start);
+        }
+        if (start + mapped > data_ + length_) {
+            munmap(data_ + length_, start + mapped - (data_ + length_));
+        }
+
+#ifdef MADV_HUGEPAGE
+        if (alignment == HugePageSize) {
+            madvise(data_, length_, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    ~FrameMemory() {
+        munmap(data_, length_);
+    }
+
+    uchar *data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    // value rounded up to a multiple of multiple
+    static size_t roundUp(size_t value, size_t multiple) {
+        return ((value + multiple - 1) / multiple) * multiple;
+    }
+
+private:
+    size_t size_;
+    size_t length_;
+    uchar *data_;
+
+    FrameMemory(const FrameMemory &) = delete;
+    FrameMemory &operator=(const FrameMemory &) = delete;
+};
+
+#endif // FRAMEMEMORY_H
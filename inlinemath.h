@@ -153,5 +153,54 @@ inline float Vector3D::dotProduct(const Vector3D &v1, const Vector3D &v2) {
     return result;
 }
 
+
+// 4 vectors in structure of arrays layout, vector n lives in lane n of x, y and z
+// used to run 4 rays through the same code at once
+struct Vector3D4 {
+    __m128 x;
+    __m128 y;
+    __m128 z;
+
+    inline Vector3D4() : x(_mm_setzero_ps()), y(_mm_setzero_ps()), z(_mm_setzero_ps()) {
+    }
+
+    inline Vector3D4(const __m128 &xx, const __m128 &yy, const __m128 &zz) : x(xx), y(yy), z(zz) {
+    }
+
+    // same vector in all 4 lanes
+    inline explicit Vector3D4(Vector3D v) : x(_mm_set1_ps(v.x())), y(_mm_set1_ps(v.y())), z(_mm_set1_ps(v.z())) {
+    }
+
+    inline Vector3D4 &operator+=(const Vector3D4 &o) {
+        x = _mm_add_ps(x, o.x);
+        y = _mm_add_ps(y, o.y);
+        z = _mm_add_ps(z, o.z);
+        return *this;
+    }
+
+    inline __m128 lengthSquared() const {
+        return dotProduct(*this, *this);
+    }
+
+    static inline __m128 dotProduct(const Vector3D4 &v1, const Vector3D4 &v2) {
+        __m128 sum = _mm_mul_ps(v1.x, v2.x);
+        sum = _mm_add_ps(sum, _mm_mul_ps(v1.y, v2.y));
+        return _mm_add_ps(sum, _mm_mul_ps(v1.z, v2.z));
+    }
+};
+
+inline const Vector3D4 operator+(const Vector3D4 &v1, const Vector3D4 &v2) {
+    return Vector3D4(_mm_add_ps(v1.x, v2.x), _mm_add_ps(v1.y, v2.y), _mm_add_ps(v1.z, v2.z));
+}
+
+inline const Vector3D4 operator-(const Vector3D4 &v1, const Vector3D4 &v2) {
+    return Vector3D4(_mm_sub_ps(v1.x, v2.x), _mm_sub_ps(v1.y, v2.y), _mm_sub_ps(v1.z, v2.z));
+}
+
+// lane by lane scale
+inline const Vector3D4 operator*(const __m128 &t, const Vector3D4 &v) {
+    return Vector3D4(_mm_mul_ps(t, v.x), _mm_mul_ps(t, v.y), _mm_mul_ps(t, v.z));
+}
+
 } // inlinemath
 #endif // INLINEMATH_H
@@ -1,4 +1,6 @@
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QCoreApplication>
 #include <QDebug>
 #include <QImage>
 #include <QLinkedList>
@@ -22,83 +24,23 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 // SSE2
 #include <emmintrin.h>
 
 #include "inlinemath.h"
 #include "scalarfield.h"
+#include "potentialfield.h"
+#include "barneshutfield.h"
+#include "framememory.h"
 #include "renderer.h"
+#include "scalingreport.h"
+#include "sharedframes.h"
+#include "tracer.h"
 
 using namespace inlinemath;
 
-class Charge : public Vector3D, public ScalarField<Charge> {
-public:
-    Charge(float x, float y, float z, float value) : Vector3D(x, y, z), value_(value) {}
-
-    Charge(const Vector3D &pos, float value) : Vector3D(pos), value_(value) {}
-
-    Charge(float value) : Charge(Vector3D(), value) {}
-
-    Charge() : Charge(Vector3D(), 1.0f) {}
-
-    Charge(const Charge &other) : Vector3D(other), value_(other.value_) {}
-
-    Charge &operator=(const Charge &other) {
-        Vector3D::operator=(other);
-        value_ = other.value_;
-        return *this;
-    }
-
-    inline float value() const {
-        return value_;
-    }
-
-    inline void setValue(const float &value) {
-        value_ = value;
-    }
-
-    inline float fieldAt(const Vector3D &pos, Vector3D &gradient) const {
-        Vector3D disp = pos - *(static_cast<const Vector3D *>(this));
-        float radius2 = disp.lengthSquared();
-        float value = value_ / radius2;
-        gradient = (float) -2.0f * value * (disp / radius2);
-        return value;
-    }
-
-    inline Vector3D pos() const {
-        return *this;
-    }
-
-    inline void setPos(const Vector3D &pos) {
-        Vector3D::operator=(pos);
-    }
-
-private:
-    float value_;
-};
-
-
-class PotentialField : public QVector<Charge>, public ScalarField<PotentialField> {
-public:
-    PotentialField() {}
-    virtual ~PotentialField() {}
-
-    inline float fieldAt(const Vector3D &pos, Vector3D &gradient) const {
-        float value = 0.0;
-        Vector3D g, lg;
-        const Charge *charges = this->constData();
-        int length = size();
-        for (int i = 0; i < length; i++) {
-            value += charges[i].fieldAt(pos, lg);
-            g += lg;
-        }
-        gradient = g;
-        return value;
-    }
-};
-
-
 class DrawingArea : public QWidget {
 public:
 
@@ -107,12 +49,21 @@ public:
         image_(createCompatibleImage(size())) {
     }
 
+    // called after each frame rendered
+    void setFrameCallback(const std::function<void()> &callback) {
+        frameCallback_ = callback;
+    }
+
 protected:
     void paintEvent(QPaintEvent *pe) override {
         (void) pe;
 
         renderer_.render(image_.get());
+        if (frameCallback_) {
+            frameCallback_();
+        }
 
+        TRACE_SCOPE("present");
         QPainter p(this);
         p.drawImage(0, 0, *image_.get());
     }
@@ -126,29 +77,33 @@ protected:
 private:
     Renderer &renderer_;
     std::unique_ptr<QImage> image_;
+    std::function<void()> frameCallback_;
 
     // we need a buffer where the number of pixels per line is a multiple of 4
     // the format is ARBG32 so each pixel is 4 bytes wide.
+    // FrameMemory is page aligned, more than Renderer::FrameAlignment asks for,
+    // and leaves the first touch of each line to the worker rendering it.
     static QImage *createCompatibleImage(const QSize &size) {
-        int bytesPerline = ((size.width() + 3) / 4) * 16;
-        uchar *data = new uchar[bytesPerline * size.height()];
+        int bytesPerline = Renderer::compatibleBytesPerLine(size.width());
+        FrameMemory *memory = new FrameMemory(bytesPerline * size.height());
         return new QImage(
-                    data,
+                    memory->data(),
                     size.width(),
                     size.height(),
                     bytesPerline,
                     QImage::Format_ARGB32,
                     cleanupImage,
-                    data);
+                    memory);
     }
 
     static void cleanupImage(void *info) {
-        delete static_cast<uchar *>(info);
+        delete static_cast<FrameMemory *>(info);
     }
 };
 
 
 void animate(PotentialField &field) {
+    TRACE_SCOPE("animate");
     static Vector3D *directions = nullptr;
     int i, size = field.size();
 
@@ -175,6 +130,46 @@ void animate(PotentialField &field) {
     }
 }
 
+// deterministic scene for measurements, charges spread over the visible area
+// with two of them close enough to merge, smaller ones on a spiral past the 5th
+void fixedScene(PotentialField &field, int count) {
+    static const float fixed[5][2] = {
+        { -3.0f, 1.5f }, { 3.0f, 1.5f }, { -3.0f, -1.5f }, { 0.8f, -1.0f }, { 2.2f, -1.5f }
+    };
+
+    field.clear();
+    for (int i = 0; i < count; i++) {
+        if (i < 5) {
+            field << Charge(fixed[i][0], fixed[i][1], 0.0f, 1.5f);
+        }
+        else {
+            float r = sqrtf((i - 4.5f) / (count - 5));
+            float a = i * 2.39996f; // golden angle
+            field << Charge(5.0f * r * cosf(a), 3.2f * r * sinf(a), 0.0f, 0.05f);
+        }
+    }
+}
+
+template <class F>
+void scalingReport(const F &field, const QSize &size, int threads, int frames, bool antialiasing) {
+    ScalingReport<F> report(field, size, threads, frames);
+    report.setAntialiasing(antialiasing);
+    report.run();
+}
+
+template <class F>
+void multiViewReport(const F &field, const QSize &size, int views, int frames) {
+    MultiViewReport<F> report(field, size, views, frames);
+    report.run();
+}
+
+template <class F>
+Renderer *createRenderer(const F &field, bool antialiasing) {
+    FieldRenderer<F> *renderer = new FieldRenderer<F>(field);
+    renderer->setAntialiasing(antialiasing);
+    return renderer;
+}
+
 // non-inlined, never called function to see the asm produced in the debugger
 float myChargeAt(const Charge &charge, const Vector3D &pos, Vector3D &gradient) {
     return charge.fieldAt(pos, gradient);
@@ -184,33 +179,174 @@ float myFieldAt(const PotentialField &field, const Vector3D &pos, Vector3D &grad
     return field.fieldAt(pos, gradient);
 }
 
+// modes rendering without a window get a QCoreApplication so that they run on hosts
+// without a display, the command line is not parsed yet so look for the options in argv
+QCoreApplication *createApplication(int &argc, char *argv[]) {
+    static const char *headless[] = { "--shm", "--file", "--scaling", "--views" };
+    for (int i = 1; i < argc; i++) {
+        for (const char *option : headless) {
+            size_t length = strlen(option);
+            if (strncmp(argv[i], option, length) == 0 && (argv[i][length] == '\0' || argv[i][length] == '=')) {
+                return new QCoreApplication(argc, argv);
+            }
+        }
+    }
+    return new QApplication(argc, argv);
+}
+
 int main(int argc, char *argv[])
 {
-    QApplication app(argc, argv);
+    std::unique_ptr<QCoreApplication> app(createApplication(argc, argv));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("metaballs");
+    parser.addHelpOption();
+    QCommandLineOption shmOption("shm", "Render headless into the POSIX shared memory ring <name>.", "name");
+    QCommandLineOption fileOption("file", "Render headless into a frame ring mmap'd from <path>.", "path");
+    QCommandLineOption sizeOption("size", "Frame size for headless rendering and benchmarks.", "WxH", "640x480");
+    QCommandLineOption slotsOption("slots", "Number of frames in the ring.", "count", "3");
+    QCommandLineOption scalingOption("scaling", "Render a fixed scene with 1 to --threads workers and report scaling.");
+    QCommandLineOption threadsOption("threads", "Highest number of workers for --scaling.", "count",
+                                     QString::number(qMax(QThread::idealThreadCount(), 1)));
+    QCommandLineOption viewsOption("views", "Render a fixed scene from <count> cameras with one renderer per camera, then with one renderer for all, and report.", "count");
+    QCommandLineOption framesOption("frames", "Frames rendered per measurement, or before quitting.", "count", "50");
+    QCommandLineOption antialiasOption("aa", "Supersample pixels on edges.");
+    QCommandLineOption chargesOption("charges", "Number of charges.", "count", "5");
+    QCommandLineOption thetaOption("theta", "Approximate the field with a Barnes-Hut tree of accuracy <theta>, 0 is exact.", "theta");
+    QCommandLineOption noNumaOption("no-numa", "Do not pin workers to NUMA nodes nor split lines between nodes.");
+    QCommandLineOption traceOption("trace", "Record spans and write them as Chrome trace JSON to <file> when quitting.", "file");
+    parser.addOption(shmOption);
+    parser.addOption(fileOption);
+    parser.addOption(sizeOption);
+    parser.addOption(slotsOption);
+    parser.addOption(scalingOption);
+    parser.addOption(threadsOption);
+    parser.addOption(viewsOption);
+    parser.addOption(framesOption);
+    parser.addOption(antialiasOption);
+    parser.addOption(chargesOption);
+    parser.addOption(thetaOption);
+    parser.addOption(noNumaOption);
+    parser.addOption(traceOption);
+    parser.process(*app);
+
+    NumaTopology::setEnabled(!parser.isSet(noNumaOption));
+
+    if (parser.isSet(traceOption)) {
+        Tracer::setEnabled(true);
+        Tracer::instance().setThreadName("main");
+    }
+
+    // quit after --frames frames when given, unless benchmarking
+    int frameCount = 0;
+    int maxFrames = parser.isSet(framesOption) ? parser.value(framesOption).toInt() : -1;
+    auto frameDone = [&]() {
+        if (++frameCount == maxFrames) {
+            app->quit();
+        }
+    };
+
+    QStringList size = parser.value(sizeOption).split('x');
+    if (size.size() != 2) {
+        parser.showHelp(1);
+    }
+    QSize frameSize(size[0].toInt(), size[1].toInt());
 
     // init charges
     PotentialField field;
-    field << Charge(1.5);
-    field << Charge(1.5);
-    field << Charge(1.5);
-    field << Charge(1.5);
-    field << Charge(1.5);
+    int charges = parser.value(chargesOption).toInt();
+    for (int i = 0; i < charges; i++) {
+        field << Charge(1.5);
+    }
+    BarnesHutField approximated(field, parser.value(thetaOption).toFloat());
+
+    // benchmark, no gui
+    if (parser.isSet(scalingOption)) {
+        fixedScene(field, charges);
+        if (parser.isSet(thetaOption)) {
+            scalingReport(approximated, frameSize, parser.value(threadsOption).toInt(),
+                          parser.value(framesOption).toInt(), parser.isSet(antialiasOption));
+        }
+        else {
+            scalingReport(field, frameSize, parser.value(threadsOption).toInt(),
+                          parser.value(framesOption).toInt(), parser.isSet(antialiasOption));
+        }
 
-    // gui
-    FieldRenderer<PotentialField> renderer(field);
-    DrawingArea da(renderer);
-    da.resize(640, 480);
-    da.show();
+        if (parser.isSet(traceOption)) {
+            Tracer::instance().exportChromeTrace(parser.value(traceOption));
+        }
+        return 0;
+    }
+
+    if (parser.isSet(viewsOption)) {
+        fixedScene(field, charges);
+        if (parser.isSet(thetaOption)) {
+            multiViewReport(approximated, frameSize, parser.value(viewsOption).toInt(), parser.value(framesOption).toInt());
+        }
+        else {
+            multiViewReport(field, frameSize, parser.value(viewsOption).toInt(), parser.value(framesOption).toInt());
+        }
+
+        if (parser.isSet(traceOption)) {
+            Tracer::instance().exportChromeTrace(parser.value(traceOption));
+        }
+        return 0;
+    }
+
+    std::unique_ptr<Renderer> renderer;
+    if (parser.isSet(thetaOption)) {
+        renderer.reset(createRenderer(approximated, parser.isSet(antialiasOption)));
+    }
+    else {
+        renderer.reset(createRenderer(field, parser.isSet(antialiasOption)));
+    }
 
-    // animation
     QTimer timer;
     timer.setInterval(0);
     timer.setSingleShot(false);
-    QObject::connect(&timer, &QTimer::timeout, [&]() {
-        animate(field);
-        da.update();
-    });
+
+    // headless, frames go straight to shared memory
+    std::unique_ptr<SharedFrameRing> ring;
+    std::unique_ptr<DrawingArea> da;
+    if (parser.isSet(shmOption) || parser.isSet(fileOption)) {
+        if (parser.isSet(shmOption)) {
+            ring.reset(new SharedFrameRing(parser.value(shmOption), SharedFrameRing::SharedMemory,
+                                           frameSize, parser.value(slotsOption).toInt()));
+        }
+        else {
+            ring.reset(new SharedFrameRing(parser.value(fileOption), SharedFrameRing::MappedFile,
+                                           frameSize, parser.value(slotsOption).toInt()));
+        }
+        if (!ring->isValid()) {
+            qWarning() << "cannot create frame ring:" << ring->errorString();
+            return 1;
+        }
+
+        QObject::connect(&timer, &QTimer::timeout, [&]() {
+            animate(field);
+            ring->render(*renderer);
+            frameDone();
+        });
+    }
+    // gui
+    else {
+        da.reset(new DrawingArea(*renderer));
+        da->resize(640, 480);
+        da->setFrameCallback(frameDone);
+        da->show();
+
+        // animation, update() requests are merged so frames are counted when painted
+        QObject::connect(&timer, &QTimer::timeout, [&]() {
+            animate(field);
+            da->update();
+        });
+    }
     timer.start();
 
-    return app.exec();
+    int result = app->exec();
+
+    if (parser.isSet(traceOption)) {
+        Tracer::instance().exportChromeTrace(parser.value(traceOption));
+    }
+    return result;
 }
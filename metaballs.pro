@@ -13,9 +13,18 @@ QMAKE_CXXFLAGS_RELEASE += -O3
 
 TEMPLATE = app
 
+# shm_open() lives in librt on older glibc
+unix:!macx: LIBS += -lrt
+
 SOURCES += main.cpp
 
 HEADERS += \
     scalarfield.h \
     inlinemath.h \
-    renderer.h
+    renderer.h \
+    sharedframes.h \
+    scalingreport.h \
+    tracer.h \
+    potentialfield.h \
+    barneshutfield.h \
+    framememory.h
@@ -0,0 +1,99 @@
+#ifndef POTENTIALFIELD_H
+#define POTENTIALFIELD_H
+#include <QVector>
+
+#include <emmintrin.h>
+
+#include "inlinemath.h"
+#include "scalarfield.h"
+
+using namespace inlinemath;
+
+class Charge : public Vector3D, public ScalarField<Charge> {
+public:
+    Charge(float x, float y, float z, float value) : Vector3D(x, y, z), value_(value) {}
+
+    Charge(const Vector3D &pos, float value) : Vector3D(pos), value_(value) {}
+
+    Charge(float value) : Charge(Vector3D(), value) {}
+
+    Charge() : Charge(Vector3D(), 1.0f) {}
+
+    Charge(const Charge &other) : Vector3D(other), value_(other.value_) {}
+
+    Charge &operator=(const Charge &other) {
+        Vector3D::operator=(other);
+        value_ = other.value_;
+        return *this;
+    }
+
+    inline float value() const {
+        return value_;
+    }
+
+    inline void setValue(const float &value) {
+        value_ = value;
+    }
+
+    inline float fieldAt(const Vector3D &pos, Vector3D &gradient) const {
+        Vector3D disp = pos - *(static_cast<const Vector3D *>(this));
+        float radius2 = disp.lengthSquared();
+        float value = value_ / radius2;
+        gradient = (float) -2.0f * value * (disp / radius2);
+        return value;
+    }
+
+    inline __m128 fieldAt4(const Vector3D4 &pos, Vector3D4 &gradient) const {
+        Vector3D4 disp = pos - Vector3D4(*this);
+        __m128 radius2 = disp.lengthSquared();
+        __m128 value = _mm_div_ps(_mm_set1_ps(value_), radius2);
+        gradient = _mm_div_ps(_mm_mul_ps(_mm_set1_ps(-2.0f), value), radius2) * disp;
+        return value;
+    }
+
+    inline Vector3D pos() const {
+        return *this;
+    }
+
+    inline void setPos(const Vector3D &pos) {
+        Vector3D::operator=(pos);
+    }
+
+private:
+    float value_;
+};
+
+
+class PotentialField : public QVector<Charge>, public ScalarField<PotentialField> {
+public:
+    PotentialField() {}
+    virtual ~PotentialField() {}
+
+    inline float fieldAt(const Vector3D &pos, Vector3D &gradient) const {
+        float value = 0.0;
+        Vector3D g, lg;
+        const Charge *charges = this->constData();
+        int length = size();
+        for (int i = 0; i < length; i++) {
+            value += charges[i].fieldAt(pos, lg);
+            g += lg;
+        }
+        gradient = g;
+        return value;
+    }
+
+    inline __m128 fieldAt4(const Vector3D4 &pos, Vector3D4 &gradient) const {
+        __m128 value = _mm_setzero_ps();
+        Vector3D4 g, lg;
+        const Charge *charges = this->constData();
+        int length = size();
+        for (int i = 0; i < length; i++) {
+            value = _mm_add_ps(value, charges[i].fieldAt4(pos, lg));
+            g += lg;
+        }
+        gradient = g;
+        return value;
+    }
+};
+
+#endif // POTENTIALFIELD_H
@@ -1,27 +1,67 @@
 #ifndef RENDERER_H
 #define RENDERER_H
 #include <QAtomicInt>
+#include <QElapsedTimer>
 #include <QImage>
 #include <QSemaphore>
 #include <QThread>
 #include <QVector>
 
+#include <algorithm>
 #include <functional>
 #include <memory>
+#include <vector>
+
+#include <string.h>
 
 #include <emmintrin.h>
 
+#include "framememory.h"
 #include "scalarfield.h"
 #include "inlinemath.h"
+#include "tracer.h"
 
 using namespace inlinemath;
 
 class Renderer {
 public:
+    // frame buffers handed to render() must start on a FrameAlignment boundary
+    // and have lines of a multiple of FrameAlignment bytes: pixels are written
+    // 4 at a time with aligned SSE2 stores, padding included.
+    // render() checks it in every build and skips, with a warning, frames going
+    // to a buffer that does not comply.
+    static constexpr int FrameAlignment = 16;
+
     virtual ~Renderer() {
     }
 
-    virtual void render(QImage *image) = 0;
+    // width rounded up to the pixel group size of the SSE2 path
+    static int paddedWidth(int width) {
+        return ((width + 3) / 4) * 4;
+    }
+
+    // smallest valid bytesPerLine for an ARGB32 frame of the given width
+    static int compatibleBytesPerLine(int width) {
+        return paddedWidth(width) * 4;
+    }
+
+    // whether a frame buffer satisfies FrameAlignment, empty frames always do
+    static bool isCompatible(const uchar *bits, const QSize &size, int bytesPerLine) {
+        if (size.isEmpty())
+            return true;
+
+        return bits != nullptr &&
+               ((quintptr) bits % FrameAlignment) == 0 &&
+               (bytesPerLine % FrameAlignment) == 0 &&
+               bytesPerLine >= compatibleBytesPerLine(size.width());
+    }
+
+    // render into a caller provided ARGB32 buffer, see FrameAlignment
+    virtual void render(uchar *bits, const QSize &size, int bytesPerLine) = 0;
+
+    void render(QImage *image) {
+        render(image->bits(), image->size(), image->bytesPerLine());
+    }
 };
 
 
@@ -41,19 +81,232 @@ private:
     const std::function<void(int)> func_;
 };
 
+template <class F> class FieldRenderer;
+
+// One camera looking at the field: frustum, frame buffer to render into, and what
+// FieldRenderer precomputes from them. Views are rendered by FieldRenderer, several
+// at once with FieldRenderer::render(const QVector<RenderView *> &).
+class RenderView {
+public:
+    RenderView() :
+        rays_(nullptr),
+        stride_(0),
+        raysHeight_(0),
+        raysValid_(false),
+        raysPending_(false),
+        hits_(nullptr),
+        levels_(nullptr),
+        bits_(nullptr),
+        bytesPerLine_(0),
+        hasTarget_(false) {
+        setFrustum(2.0, 50.0, -2.0, 37.5);
+    }
+
+    void setFrustum(float front, float frontZoom, float back, float backZoom) {
+        front_ = front;
+        frontZoom_ = frontZoom;
+        back_ = back;
+        backZoom_ = backZoom;
+        raysValid_ = false;
+    }
+
+    // ARGB32 buffer the next frame goes to, see Renderer::FrameAlignment
+    // returns false and leaves the view without target when the buffer does not
+    // comply, FieldRenderer skips frames with such views
+    bool setTarget(uchar *bits, const QSize &size, int bytesPerLine) {
+        if (!Renderer::isCompatible(bits, size, bytesPerLine)) {
+            qWarning() << __func__ << "incompatible frame buffer" << (void *) bits << size << bytesPerLine;
+            hasTarget_ = false;
+            return false;
+        }
+
+        if (size_ != size) {
+            size_ = size;
+            raysValid_ = false;
+        }
+        bits_ = bits;
+        bytesPerLine_ = bytesPerLine;
+        hasTarget_ = true;
+        return true;
+    }
+
+    bool setTarget(QImage *image) {
+        return setTarget(image->bits(), image->size(), image->bytesPerLine());
+    }
+
+    QSize size() const {
+        return size_;
+    }
+
+private:
+    template <class F> friend class FieldRenderer;
+
+    struct Ray {
+        Vector3D p;
+        Vector3D direction;
+        float length;
+    };
+
+    float front_;
+    float frontZoom_;
+    float back_;
+    float backZoom_;
+
+    QTransform frontTransform_;
+    QTransform frontTransformInverted_;
+    QTransform backTransform_;
+    QTransform backTransformInverted_;
+
+    // precalculated rays, filled by the workers (see FrameMemory)
+    std::unique_ptr<FrameMemory> raysMemory_;
+    Ray *rays_;
+    int stride_;
+    int raysHeight_;
+    bool raysValid_;
+    bool raysPending_;  // allocated, not filled yet
+
+    // ray origin and end displacement for one pixel along x and y
+    Vector3D frontDx_;
+    Vector3D frontDy_;
+    Vector3D backDx_;
+    Vector3D backDy_;
+
+    // result of the shading pass for the antialiasing pass, same layout as rays_
+    std::unique_ptr<FrameMemory> hitsMemory_;
+    std::unique_ptr<FrameMemory> levelsMemory_;
+    uchar *hits_;
+    uchar *levels_;
+
+    // image size
+    QSize size_;
+
+    // frame buffer
+    uchar *bits_;
+    int bytesPerLine_;
+    bool hasTarget_;
+
+    // update transformation matrices
+    void updateTransforms() {
+        int w = size_.width();
+        int h = size_.height();
+        frontTransform_ = QTransform::fromTranslate(w / 2, h / 2).scale(frontZoom_, -frontZoom_);
+        frontTransformInverted_ = frontTransform_.inverted();
+        backTransform_ = QTransform::fromTranslate(w / 2, h / 2).scale(backZoom_, -backZoom_);
+        backTransformInverted_ = backTransform_.inverted();
+    }
+
+    // prepare for new rays, filled line by line by fillRays()
+    // buffers are only reallocated when the size changed, a frustum change refills
+    // them in place
+    void updateRays() {
+        TRACE_SCOPE("updateRays");
+
+        updateTransforms();
+
+        int w = Renderer::paddedWidth(size_.width());
+        int h = size_.height();
+
+        if (!raysMemory_ || stride_ != w || raysHeight_ != h) {
+            raysMemory_.reset(new FrameMemory(sizeof(Ray) * w * h));
+            rays_ = reinterpret_cast<Ray *>(raysMemory_->data());
+            stride_ = w;
+            raysHeight_ = h;
+
+            hitsMemory_.reset(new FrameMemory(w * h));
+            levelsMemory_.reset(new FrameMemory(w * h));
+            hits_ = hitsMemory_->data();
+            levels_ = levelsMemory_->data();
+        }
+
+        QPointF f0 = frontTransformInverted_.map(QPointF(0, 0));
+        QPointF fx = frontTransformInverted_.map(QPointF(1, 0));
+        QPointF fy = frontTransformInverted_.map(QPointF(0, 1));
+        QPointF b0 = backTransformInverted_.map(QPointF(0, 0));
+        QPointF bx = backTransformInverted_.map(QPointF(1, 0));
+        QPointF by = backTransformInverted_.map(QPointF(0, 1));
+        frontDx_ = Vector3D(fx.x() - f0.x(), fx.y() - f0.y(), 0.0f);
+        frontDy_ = Vector3D(fy.x() - f0.x(), fy.y() - f0.y(), 0.0f);
+        backDx_ = Vector3D(bx.x() - b0.x(), bx.y() - b0.y(), 0.0f);
+        backDy_ = Vector3D(by.x() - b0.x(), by.y() - b0.y(), 0.0f);
+
+        raysValid_ = false;
+        raysPending_ = true;
+    }
+
+    // compute the rays of line y, and clear its antialiasing buffers so that they
+    // are first touched by the same worker
+    void fillRays(int y) {
+        memset(hits_ + y * stride_, 0, stride_);
+        memset(levels_ + y * stride_, 0, stride_);
+
+        Ray *rays = rays_ + y * stride_;
+        for (int x = 0; x < stride_; x++) {
+            QPointF pos(x, y);
+            QPointF f = frontTransformInverted_.map(pos);
+            QPointF b = backTransformInverted_.map(pos);
+            Vector3D front(f.x(), f.y(), front_);
+            Vector3D back(b.x(), b.y(), back_);
+
+            Vector3D direction = back - front;
+            float length = direction.length();
+            direction /= length;
+
+            Ray *r = new (&rays[x]) Ray;
+            r->p = front;
+            r->direction = direction;
+            r->length = length;
+        }
+    }
+};
+
 template <class F>
 class FieldRenderer : public Renderer {
 public:
-    FieldRenderer(const F &field) : field_(field), image_(nullptr), lineNumber_(0) {
-        qDebug() << __func__ << "in";
+    using Renderer::render;
 
-        setFrustum(2.0, 50.0, -2.0, 37.5);
+    // per worker counters, accumulated over frames until resetStats()
+    struct ThreadStats {
+        ThreadStats() : lines(0), busyNs(0), idleNs(0) {}
 
-        threadCount_ = QThread::idealThreadCount();
+        int lines;          // lines rendered
+        qint64 busyNs;      // time spent rendering lines
+        qint64 idleNs;      // time spent waiting at the end of frame barrier for the other workers
+    };
+
+    // threadCount <= 0 means one worker per core
+    FieldRenderer(const F &field, int threadCount = 0) :
+        field_(field),
+        antialiasing_(false),
+        lightSource_(0.0, 0.0, 50.0),
+        pass_(ShadePass) {
+        qDebug() << __func__ << "in";
+
+        threadCount_ = threadCount > 0 ? threadCount : QThread::idealThreadCount();
         if (threadCount_ == -1) {
             threadCount_ = 1;
         }
 
+        // lines are split between nodes in proportion to their workers, workers take
+        // lines of their node first; nodes without workers get no lines
+        const NumaTopology &topology = NumaTopology::instance();
+        nodeCount_ = topology.nodeCount();
+        nodeLines_.reset(new LineCounter[nodeCount_]);
+        nodeTotal_.assign(nodeCount_, 0);
+        nodeFirstWorker_.assign(nodeCount_ + 1, 0);
+        for (int i = 0; i < nodeCount_; i++) {
+            nodeLines_[i].value = 0;
+        }
+        for (int i = 0; i < threadCount_; i++) {
+            int node = topology.nodeOfWorker(i, threadCount_);
+            workerNodes_.push_back(node);
+            nodeFirstWorker_[node + 1]++;
+        }
+        for (int k = 0; k < nodeCount_; k++) {
+            nodeFirstWorker_[k + 1] += nodeFirstWorker_[k];
+        }
+
+        resetStats();
+
         workers_ = new QThread *[threadCount_];
         for (int i = 0; i < threadCount_; i++) {
             workers_[i] = new WorkerThread(i, std::bind(&FieldRenderer::process, this, std::placeholders::_1));
@@ -74,69 +327,177 @@ public:
             delete workers_[i];
             workers_[i] = nullptr;
         }
-        delete workers_;
+        delete[] workers_;
 
         qDebug() << __func__ << "out";
     }
 
+    // frustum of the view used by render(bits, size, bytesPerLine)
     void setFrustum(float front, float frontZoom, float back, float backZoom) {
-        front_ = front;
-        frontZoom_ = frontZoom;
-        back_ = back;
-        backZoom_ = backZoom;
+        view_.setFrustum(front, frontZoom, back, backZoom);
+    }
 
-        updateTransforms();
+    // when enabled, a second pass supersamples the pixels found on silhouettes or
+    // strong shading gradients by the first one
+    void setAntialiasing(bool enable) {
+        antialiasing_ = enable;
     }
 
-    void render(QImage *image) override {
-        QSize size = image->size();
-        if (size_ != size) {
-            size_ = size;
-            updateTransforms();
-            updateRays();
+    bool antialiasing() const {
+        return antialiasing_;
+    }
+
+    void render(uchar *bits, const QSize &size, int bytesPerLine) override {
+        if (!view_.setTarget(bits, size, bytesPerLine))
+            return;
+
+        render(QVector<RenderView *>() << &view_);
+    }
+
+    // render all views at once: the field is prepared once for all of them and
+    // lines of all views are shared among the workers
+    void render(const QVector<RenderView *> &views) {
+        TRACE_SCOPE("render");
+
+        for (const RenderView *view : views) {
+            if (!view->hasTarget_) {
+                qWarning() << __func__ << "view without a valid frame buffer, frame skipped";
+                return;
+            }
+        }
+
+        // lines of view v on node k are numbered from nodeViewLines_[k * (views + 1) + v]
+        views_.assign(views.constBegin(), views.constEnd());
+        nodeViewLines_.resize(nodeCount_ * (views.size() + 1));
+        bool raysPending = false;
+        for (int v = 0; v < views.size(); v++) {
+            RenderView *view = views[v];
+            if (!view->raysValid_ && !view->raysPending_) {
+                view->updateRays();
+            }
+            raysPending |= view->raysPending_;
+        }
+        for (int k = 0; k < nodeCount_; k++) {
+            int *lines = nodeViewLines_.data() + k * (views.size() + 1);
+            lines[0] = 0;
+            for (int v = 0; v < views.size(); v++) {
+                int h = views[v]->size_.height();
+                lines[v + 1] = lines[v] + nodeFirstLine(h, k + 1) - nodeFirstLine(h, k);
+            }
+            nodeTotal_[k] = lines[views.size()];
+        }
+
+        // rays are computed by the workers that will use them, see FrameMemory
+        if (raysPending) {
+            runPass(RaysPass);
+            for (RenderView *view : views) {
+                view->raysPending_ = false;
+                view->raysValid_ = true;
+            }
         }
 
-        QTime time;
+        QElapsedTimer time;
         time.start();
 
-        image_ = image;
-        semaphoreBeginWorking_.release(threadCount_);
-        semaphoreWorkDone_.acquire(threadCount_);
-        lineNumber_ = 0;
-        semaphoreStartWaiting_.release(threadCount_);
-        image_ = nullptr;
+        {
+            TRACE_SCOPE("prepare");
+            field_.prepare();
+        }
+        qint64 prepared = time.nsecsElapsed();
+
+        std::fill(frameBusyNs_.begin(), frameBusyNs_.end(), 0);
+
+        runPass(ShadePass);
+        if (antialiasing_) {
+            runPass(AntialiasPass);
+        }
+        qint64 elapsed = time.nsecsElapsed();
 
-        qDebug() << __func__ << time.elapsed() << "ms";
+        // workers are waiting for the next pass, their counters are stable
+        // they are parked during prepare(), that is not time idle at the barrier
+        for (int i = 0; i < threadCount_; i++) {
+            ThreadStats &stats = stats_[i];
+            stats.busyNs += frameBusyNs_[i];
+            stats.idleNs += elapsed - prepared - frameBusyNs_[i];
+        }
+        frames_++;
+        prepareNs_ += prepared;
+        elapsedNs_ += elapsed;
+
+        views_.clear();
+
+        qDebug() << __func__ << elapsed / 1000000 << "ms";
     }
 
-private:
-    const F &field_;
+    int threadCount() const {
+        return threadCount_;
+    }
 
-    float front_;
-    float frontZoom_;
-    float back_;
-    float backZoom_;
+    // frames rendered and their total duration since the last resetStats()
+    int frames() const {
+        return frames_;
+    }
 
-    QTransform frontTransform_;
-    QTransform frontTransformInverted_;
-    QTransform backTransform_;
-    QTransform backTransformInverted_;
+    qint64 elapsedNs() const {
+        return elapsedNs_;
+    }
 
-    struct Ray {
-        Vector3D p;
-        Vector3D direction;
-        float length;
+    // part of elapsedNs() spent in field.prepare() on the calling thread
+    qint64 prepareNs() const {
+        return prepareNs_;
+    }
+
+    const std::vector<ThreadStats> &threadStats() const {
+        return stats_;
+    }
+
+    // only call between two render()
+    void resetStats() {
+        stats_.assign(threadCount_, ThreadStats());
+        frameBusyNs_.assign(threadCount_, 0);
+        frames_ = 0;
+        prepareNs_ = 0;
+        elapsedNs_ = 0;
+    }
+
+private:
+    // pixels differing by more than this from a neighbour are antialiased
+    static constexpr int EdgeThreshold = 24;
+
+    // keeps line counters of different nodes on different cache lines
+    struct LineCounter {
+        volatile int value;
+        char padding[60];
     };
 
-    // precalculated rays
-    std::unique_ptr<Ray> rays_;
-    int stride_;
+    enum Pass {
+        RaysPass,       // fill the rays of resized views
+        ShadePass,      // one ray per pixel
+        AntialiasPass   // 4 rays for pixels on edges
+    };
 
-    // last image size
-    QSize size_;
+    typedef RenderView::Ray Ray;
 
-    // temporary pointer to image used during rendering
-    QImage *image_;
+    const F &field_;
+    bool antialiasing_;
+    Vector3D lightSource_;
+
+    // view used by render(bits, size, bytesPerLine)
+    RenderView view_;
+
+    // views being rendered
+    // containers read by the workers are std::vector: QVector's non const operator[]
+    // detaches shared data, which races when several workers do it at once
+    std::vector<RenderView *> views_;
+
+    // numa nodes, node of each worker, first worker of each node, line counter,
+    // view lines and number of lines per node
+    int nodeCount_;
+    std::vector<int> workerNodes_;
+    std::vector<int> nodeFirstWorker_;
+    std::unique_ptr<LineCounter[]> nodeLines_;
+    std::vector<int> nodeViewLines_;
+    std::vector<int> nodeTotal_;
 
     // threading
     volatile int threadCount_;
@@ -144,153 +505,290 @@ private:
     QSemaphore semaphoreBeginWorking_;
     QSemaphore semaphoreWorkDone_;
     QSemaphore semaphoreStartWaiting_;
-    volatile int lineNumber_;
-
-    // update transformation matrices
-    void updateTransforms() {
-        int w = size_.width();
-        int h = size_.height();
-        frontTransform_ = QTransform::fromTranslate(w / 2, h / 2).scale(frontZoom_, -frontZoom_);
-        frontTransformInverted_ = frontTransform_.inverted();
-        backTransform_ = QTransform::fromTranslate(w / 2, h / 2).scale(backZoom_, -backZoom_);
-        backTransformInverted_ = backTransform_.inverted();
+    volatile Pass pass_;
+
+    // statistics, each worker only writes its own entries
+    std::vector<ThreadStats> stats_;
+    std::vector<qint64> frameBusyNs_;
+    int frames_;
+    qint64 prepareNs_;
+    qint64 elapsedNs_;
+
+    // run one pass over all views on all workers and wait for it to complete
+    void runPass(Pass pass) {
+        pass_ = pass;
+        semaphoreBeginWorking_.release(threadCount_);
+        {
+            TRACE_SCOPE("wait workers");
+            semaphoreWorkDone_.acquire(threadCount_);
+        }
+        for (int i = 0; i < nodeCount_; i++) {
+            nodeLines_[i].value = 0;
+        }
+        semaphoreStartWaiting_.release(threadCount_);
     }
 
-    // update precomputed rays
-    void updateRays() {
-        QTime time;
-        time.start();
+    void process(int threadNumber) {
+        qDebug() << "thread" << threadNumber << "in";
+        Tracer::instance().setThreadName(QString("worker %1").arg(threadNumber));
+        NumaTopology::instance().pinCurrentThread(workerNodes_[threadNumber]);
+        int node = workerNodes_[threadNumber];
 
-        int w = ((size_.width() + 3) / 4) * 4; // multiple of 4;
-        int h = size_.height();
+        semaphoreStartWaiting_.release();
 
-        Ray *rays = new Ray[w * h];
-        int index = 0;
-        for (int y = 0; y < h; y++) {
-            for (int x = 0; x < w; x++) {
-                Ray &r = rays[index++];
+        while (true) {
+            semaphoreBeginWorking_.acquire();
 
-                QPointF pos(x, y);
-                QPointF f = frontTransformInverted_.map(pos);
-                QPointF b = backTransformInverted_.map(pos);
-                Vector3D front(f.x(), f.y(), front_);
-                Vector3D back(b.x(), b.y(), back_);
+            if (threadCount_ == 0)
+                break;
 
-                Vector3D direction = back - front;
-                float length = direction.length();
-                direction /= length;
+            QElapsedTimer busy;
+            busy.start();
 
-                r.p = front;
-                r.direction = direction;
-                r.length = length;
+            switch (pass_) {
+            case RaysPass:
+                fillRays(node);
+                break;
+            case ShadePass:
+                stats_[threadNumber].lines += shadeLines(node);
+                break;
+            case AntialiasPass:
+                antialiasLines(node);
+                break;
             }
+
+            frameBusyNs_[threadNumber] += busy.nsecsElapsed();
+
+            TRACE_SCOPE("barrier");
+            semaphoreWorkDone_.release();
+            semaphoreStartWaiting_.acquire();
         }
 
-        rays_.reset(rays);
-        stride_ = w;
+        qDebug() << "thread" << threadNumber << "out";
+    }
 
-        qDebug() << __func__ << time.elapsed() << "ms";
+    // first line of a view of height h that belongs to node k
+    inline int nodeFirstLine(int h, int k) const {
+        return h * nodeFirstWorker_[k] / nodeFirstWorker_[nodeCount_];
     }
 
-    void process(int threadNumber) {
-        float dotProduct[4];
-        float lengthSquaredNorm[4];
-        float lengthSquaredLight[4];
-        uchar pixel[4];
+    // each thread is going to find itself a line to draw until there's none left,
+    // taking lines of its own node first, then helping the others if steal is set
+    inline bool nextLine(int node, RenderView *&view, int &y, bool steal = true) {
+        int nodes = steal ? nodeCount_ : 1;
+        for (int i = 0; i < nodes; i++) {
+            int k = (node + i) % nodeCount_;
+            int line = __sync_fetch_and_add(&nodeLines_[k].value, 1);
+            if (line >= nodeTotal_[k])
+                continue;
+
+            const int *lines = nodeViewLines_.data() + k * (views_.size() + 1);
+            int v = 0;
+            while (line >= lines[v + 1]) {
+                v++;
+            }
+            view = views_[v];
+            y = nodeFirstLine(view->size_.height(), k) + line - lines[v];
+            return true;
+        }
+        return false;
+    }
+
+    // first touch of the rays of resized views, without stealing so that every line
+    // lands on the node that renders it
+    void fillRays(int node) {
+        RenderView *view;
+        int y;
+        while (nextLine(node, view, y, false)) {
+            if (view->raysPending_) {
+                TRACE_SCOPE("rays line", y);
+                view->fillRays(y);
+            }
+        }
+    }
+
+    // turn the lighting terms of 4 pixels into 4 ARGB32 gray levels
+    static inline __m128i shade4(__m128 dotp, __m128 lengthSquaredLight, __m128 lengthSquaredNorm) {
+        const __m128 zero = _mm_set1_ps(0.0f);
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 f255 = _mm_set1_ps(255.0f);
+        __m128 div;
+        __m128i light;
+
+        // a little sse magic
+        div = _mm_mul_ps(lengthSquaredLight, lengthSquaredNorm);    // div = light^2 * norm^2
+        div = _mm_sqrt_ps(div);         // div = sqrt(light^2 * norm^2)
+        dotp = _mm_div_ps(dotp, div);   // dotp = dotProduct(norm/|norm|, light/|light|)
+        dotp = _mm_max_ps(dotp, zero);  // nothing under 0
+        dotp = _mm_min_ps(dotp, one);   // nothing above 1
+        dotp = _mm_mul_ps(dotp, f255);  // expand to 0..255
+
+        light = _mm_cvtps_epi32(dotp);  // convert to 4 * int32 in 0..255
+        return light;
+    }
+
+    // qRgb(l, l, l) on 4 pixels at once: 0xff000000 | l << 16 | l << 8 | l
+    static inline __m128i gray4(__m128i light) {
+        light = _mm_or_si128(light, _mm_slli_epi32(light, 8));
+        light = _mm_or_si128(light, _mm_slli_epi32(light, 8));
+        return _mm_or_si128(light, _mm_set1_epi32(0xff000000));
+    }
+
+    // one ray per pixel, returns the number of lines drawn
+    int shadeLines(int node) {
+        alignas(16) float dotProduct[4];
+        alignas(16) float lengthSquaredNorm[4];
+        alignas(16) float lengthSquaredLight[4];
+        alignas(16) uchar hit[4];
 
         Vector3D i;
         Vector3D normal;
         Vector3D lightVec;
 
-        __m128 dotp, a, b, div;
-        __m128 zero = _mm_set1_ps(0.0f);
-        __m128 one = _mm_set1_ps(1.0f);
-        __m128 f255 = _mm_set1_ps(255.0f);
         __m128i light;
 
-        qDebug() << "thread" << threadNumber << "in";
+        uchar *line = nullptr;
+        int lines = 0;
+
+        RenderView *view;
+        int y;
+        while (nextLine(node, view, y)) {
+            TRACE_SCOPE("line", y);
+            Ray *rays = view->rays_;
+            int stride = view->stride_;
+            int w = view->size_.width();
+            line = view->bits_ + y * view->bytesPerLine_;
+            lines++;
+
+            // lines commented out in the margin are the former non SSE2 code
+            // that does not seem to be actually slower (why i kept it, just in case)
+            for (int x = 0; x < w; x += 4) {
+                for (int n = 0; n < 4; n++) {
+                    Ray &r = rays[y * stride + x + n];
+//                    uint c = 0;
+
+                    if (field_.intersect(r.p, r.direction, r.length, i, normal)) {
+//                        normal.normalize();
+                        lightVec = i - lightSource_;
+//                        lightVec.normalize();
+//                        float light = Vector3D::dotProduct(normal, lightVec);
+//                        if (light < 0.0) light = 0.0;
+//                        if (light > 1.0) light = 1.0;
+//                        c = light * 255;
+
+                        dotProduct[n] = Vector3D::dotProduct(normal, lightVec);
+                        lengthSquaredNorm[n] = normal.lengthSquared();
+                        lengthSquaredLight[n] = lightVec.lengthSquared();
+                        hit[n] = 1;
+                    }
+                    else {
+                        dotProduct[n] = 0.0f;
+                        lengthSquaredNorm[n] = 1.0f;
+                        lengthSquaredLight[n] = 1.0f;
+                        hit[n] = 0;
+                    }
+//                    ((uint *) line)[x + n] = qRgb(c, c, c);
+                }
 
-        semaphoreStartWaiting_.release();
+                light = shade4(_mm_load_ps(dotProduct), _mm_load_ps(lengthSquaredLight), _mm_load_ps(lengthSquaredNorm));
 
-        // temp: set light sources elsewhere
-        Vector3D lightSource(0.0, 0.0, 50.0);
+                // keep hits and levels around for edge detection
+                *((int *) &view->hits_[y * stride + x]) = *((int *) hit);
+                __m128i levels = _mm_packs_epi32(light, light);     // convert to 2 * 4 * int16 (sort of)
+                levels = _mm_packus_epi16(levels, levels);          // same to 2 * 2 * 4 * uint8
+                *((int *) &view->levels_[y * stride + x]) = _mm_cvtsi128_si32(levels);
 
-        while (true) {
-            semaphoreBeginWorking_.acquire();
+                // write the 4 pixels, x is a multiple of 4 and lines are aligned
+                _mm_store_si128((__m128i *) &((uint *) line)[x], gray4(light));
+            }
+        }
 
-            if (threadCount_ == 0)
-                break;
+        return lines;
+    }
 
-            uchar *bits = image_->bits(), *line = nullptr;
-            int bytesPerLine = image_->bytesPerLine();
-            Ray *rays = rays_.get();
-
-            int w = size_.width();
-            int h = size_.height();
-
-            // each thread is going to find itself a line to draw until there's none left
-            int y;
-            while ((y = __sync_fetch_and_add(&lineNumber_, 1)) < h) {
-                line = bits + y * bytesPerLine;
-
-                // lines commented out in the margin are the former non SSE2 code
-                // that does not seem to be actually slower (why i kept it, just in case)
-                for (int x = 0; x < w; x += 4) {
-                    for (int n = 0; n < 4; n++) {
-                        Ray &r = rays[y * stride_ + x + n];
-//                        uint c = 0;
-
-                        if (field_.intersect(r.p, r.direction, r.length, i, normal)) {
-//                            normal.normalize();
-                            lightVec = i - lightSource;
-//                            lightVec.normalize();
-//                            float light = Vector3D::dotProduct(normal, lightVec);
-//                            if (light < 0.0) light = 0.0;
-//                            if (light > 1.0) light = 1.0;
-//                            c = light * 255;
-
-                            dotProduct[n] = Vector3D::dotProduct(normal, lightVec);
-                            lengthSquaredNorm[n] = normal.lengthSquared();
-                            lengthSquaredLight[n] = lightVec.lengthSquared();
-                        }
-                        else {
-                            dotProduct[n] = 0.0f;
-                            lengthSquaredNorm[n] = 1.0f;
-                            lengthSquaredLight[n] = 1.0f;
-                        }
-//                        ((uint *) line)[x + n] = qRgb(c, c, c);
-                    }
+    // whether the first pass found pixel (x, y) on a silhouette or a strong gradient
+    inline bool isEdge(const RenderView &view, int x, int y) const {
+        const uchar *hits = view.hits_;
+        const uchar *levels = view.levels_;
+        int stride = view.stride_;
+        int w = view.size_.width();
+        int h = view.size_.height();
+        int index = y * stride + x;
+        uchar hit = hits[index];
+        int level = levels[index];
+
+        auto differs = [&](int other) {
+            return hits[other] != hit || std::abs(levels[other] - level) > EdgeThreshold;
+        };
+
+        return (x > 0 && differs(index - 1)) ||
+               (x + 1 < w && differs(index + 1)) ||
+               (y > 0 && differs(index - stride)) ||
+               (y + 1 < h && differs(index + stride));
+    }
 
-                    // a little sse magic
-                    dotp = _mm_load_ps(dotProduct);
-                    a = _mm_load_ps(lengthSquaredLight);
-                    b = _mm_load_ps(lengthSquaredNorm);
-
-                    div = _mm_mul_ps(a, b);         // div = light^2 * norm^2
-                    div = _mm_sqrt_ps(div);         // div = sqrt(light^2 * norm^2)
-                    dotp = _mm_div_ps(dotp, div);   // dotp = dotProduct(norm/|norm|, light/|light|)
-                    dotp = _mm_max_ps(dotp, zero);  // nothing under 0
-                    dotp = _mm_min_ps(dotp, one);   // nothing above 1
-                    dotp = _mm_mul_ps(dotp, f255);  // expand to 0..255
-
-                    light = _mm_cvtps_epi32(dotp);  // convert to 4 * int32
-                    light = _mm_packs_epi32(light, light);  // convert to 2 * 4 * int16 (sort of)
-                    light = _mm_packus_epi16(light, light); // same to 2 * 2 * 4 * unit8
-                    *((int *) &pixel[0]) = _mm_cvtsi128_si32(light);    // write 32 LSB to pixels
-
-                    // write the pixels, unroll loop
-                    ((uint *) line)[x + 1] = qRgb(pixel[0], pixel[0], pixel[0]);
-                    ((uint *) line)[x + 2] = qRgb(pixel[1], pixel[1], pixel[1]);
-                    ((uint *) line)[x + 3] = qRgb(pixel[2], pixel[2], pixel[2]);
-                    ((uint *) line)[x + 4] = qRgb(pixel[3], pixel[3], pixel[3]);
+    // second pass, edge pixels get 4 rays on a rotated grid marched together, one per
+    // SSE lane, through the packet version of intersect
+    void antialiasLines(int node) {
+        // rotated grid sample offsets in pixels
+        static const float sampleX[4] = { -0.125f, 0.375f, 0.125f, -0.375f };
+        static const float sampleY[4] = { -0.375f, -0.125f, 0.375f, 0.125f };
+        const __m128i laneBits = _mm_set_epi32(8, 4, 2, 1);
+
+        alignas(16) float px[4], py[4], pz[4];
+        alignas(16) float dx[4], dy[4], dz[4];
+        alignas(16) float length[4];
+        alignas(16) int light[4];
+
+        Vector3D4 i;
+        Vector3D4 normal;
+        Vector3D4 lightSource(lightSource_);
+        const __m128 one = _mm_set1_ps(1.0f);
+
+        RenderView *view;
+        int y;
+        while (nextLine(node, view, y)) {
+            TRACE_SCOPE("antialias line", y);
+            Ray *rays = view->rays_;
+            int w = view->size_.width();
+            uint *line = (uint *) (view->bits_ + y * view->bytesPerLine_);
+
+            for (int x = 0; x < w; x++) {
+                if (!isEdge(*view, x, y))
+                    continue;
+
+                Ray &r = rays[y * view->stride_ + x];
+                Vector3D back = r.p + r.length * r.direction;
+                for (int n = 0; n < 4; n++) {
+                    Vector3D front = r.p + sampleX[n] * view->frontDx_ + sampleY[n] * view->frontDy_;
+                    Vector3D direction = back + sampleX[n] * view->backDx_ + sampleY[n] * view->backDy_ - front;
+                    length[n] = direction.length();
+                    direction /= length[n];
+
+                    px[n] = front.x();
+                    py[n] = front.y();
+                    pz[n] = front.z();
+                    dx[n] = direction.x();
+                    dy[n] = direction.y();
+                    dz[n] = direction.z();
                 }
-            }
 
-            semaphoreWorkDone_.release();
-            semaphoreStartWaiting_.acquire();
-        }
+                int hits = field_.intersect4(Vector3D4(_mm_load_ps(px), _mm_load_ps(py), _mm_load_ps(pz)),
+                                             Vector3D4(_mm_load_ps(dx), _mm_load_ps(dy), _mm_load_ps(dz)),
+                                             _mm_load_ps(length), i, normal);
+                __m128 hit = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(hits), laneBits), laneBits));
 
-        qDebug() << "thread" << threadNumber << "out";
+                // same lighting as the first pass, missed lanes are black
+                Vector3D4 lightVec = i - lightSource;
+                __m128 dotp = _mm_and_ps(hit, Vector3D4::dotProduct(normal, lightVec));
+                __m128 a = _mm_or_ps(_mm_and_ps(hit, lightVec.lengthSquared()), _mm_andnot_ps(hit, one));
+                __m128 b = _mm_or_ps(_mm_and_ps(hit, normal.lengthSquared()), _mm_andnot_ps(hit, one));
+                _mm_store_si128((__m128i *) light, shade4(dotp, a, b));
+
+                int c = (light[0] + light[1] + light[2] + light[3] + 2) / 4;
+                line[x] = qRgb(c, c, c);
+            }
+        }
     }
 };
 #endif // RENDERER_H
@@ -42,10 +42,34 @@ public:
         }
     }
 
+    // called by renderers once per frame before casting any ray, so that fields
+    // can build whatever they derive from their sources; nothing to do by default
+    inline void prepare() const {
+    }
+
     inline float fieldAt(const Vector3D &pos, Vector3D &gradient) const {
         return static_cast<const D*>(this)->fieldAt(pos, gradient);
     }
 
+    // packet version of fieldAt(), 4 positions at once
+    // fallback calling fieldAt() lane by lane, implementations should provide a real one
+    inline __m128 fieldAt4(const Vector3D4 &pos, Vector3D4 &gradient) const {
+        alignas(16) float x[4], y[4], z[4];
+        alignas(16) float value[4], gx[4], gy[4], gz[4];
+        _mm_store_ps(x, pos.x);
+        _mm_store_ps(y, pos.y);
+        _mm_store_ps(z, pos.z);
+        for (int n = 0; n < 4; n++) {
+            Vector3D g;
+            value[n] = static_cast<const D*>(this)->fieldAt(Vector3D(x[n], y[n], z[n]), g);
+            gx[n] = g.x();
+            gy[n] = g.y();
+            gz[n] = g.z();
+        }
+        gradient = Vector3D4(_mm_load_ps(gx), _mm_load_ps(gy), _mm_load_ps(gz));
+        return _mm_load_ps(value);
+    }
+
     // (p, direction) -> starting point and normalized direction vector for the line to insect with
     // length -> max length to explore starting from p
     // i -> intersection if any
@@ -112,6 +136,48 @@ public:
         return false;
     }
 
+    // packet version of intersect(), marches 4 rays in lockstep, one per SSE lane
+    // lanes that are done stay in place while the others keep going
+    // returns the lanes that hit as a bit mask, bit n for lane n, i and g are only
+    // meaningful for those lanes
+    // metrics are not updated
+    inline int intersect4(const Vector3D4 &p, const Vector3D4 &direction, const __m128 &length, Vector3D4 &i, Vector3D4 &g) const {
+        const __m128 signMask = _mm_set1_ps(-0.0f);
+        const __m128 iso = _mm_set1_ps(isovalue);
+        const __m128 eps = _mm_set1_ps(epsilon);
+        const __m128 maxStep = _mm_set1_ps(step);
+        const __m128 minStep = _mm_set1_ps(-step);
+
+        __m128 walked = _mm_setzero_ps();
+        __m128 active = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+        Vector3D4 pos = p;
+        Vector3D4 gradient;
+        // as in intersect(), lanes still marching after max_iterations steps miss, without
+        // checking whether the last step converged
+        for (int iterations = 0; iterations < max_iterations; iterations++) {
+            __m128 delta = _mm_sub_ps(iso, static_cast<const D*>(this)->fieldAt4(pos, gradient));
+            active = _mm_and_ps(active, _mm_cmpgt_ps(_mm_andnot_ps(signMask, delta), eps));
+            active = _mm_and_ps(active, _mm_cmplt_ps(walked, length));
+            if (_mm_movemask_ps(active) == 0)
+                break;
+
+            // gradient value projected on direction
+            __m128 gradval = _mm_andnot_ps(signMask, Vector3D4::dotProduct(gradient, direction));
+            __m128 disp = _mm_div_ps(delta, gradval);
+            disp = _mm_min_ps(_mm_max_ps(disp, minStep), maxStep); // going too fast ?
+            disp = _mm_and_ps(disp, active);                        // lanes done don't move
+            pos += disp * direction;
+            walked = _mm_add_ps(walked, disp);
+        }
+
+        i = pos;
+        g = gradient;
+
+        // lanes still active ran out of iterations
+        return _mm_movemask_ps(_mm_andnot_ps(active, _mm_cmplt_ps(walked, length)));
+    }
+
 private:
     // constants
     static constexpr float isovalue = 1.0;
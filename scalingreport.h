@@ -0,0 +1,209 @@
+#ifndef SCALINGREPORT_H
+#define SCALINGREPORT_H
+#include <QSize>
+#include <QTextStream>
+#include <QVector>
+
+#include <memory>
+#include <vector>
+
+#include <stdio.h>
+
+#include "framememory.h"
+#include "renderer.h"
+
+// Renders the same scene with 1..maxThreads workers and prints, for each thread count,
+// the frame time, of which the single threaded field.prepare(), speedup and parallel
+// efficiency against the single threaded run, then per worker lines per frame, busy
+// time and time spent idle at the end of frame barrier. A thread count is flagged as
+// imbalanced when the busiest worker works more than ImbalanceThreshold times the
+// average. Each thread count renders into its own frame buffer so that its pages are
+// first touched by its own workers, see FrameMemory.
+template <class F>
+class ScalingReport {
+public:
+    static constexpr double ImbalanceThreshold = 1.10;
+
+    ScalingReport(const F &field, const QSize &size, int maxThreads, int frames) :
+        field_(field),
+        size_(size),
+        maxThreads_(maxThreads),
+        frames_(frames),
+        antialiasing_(false) {
+    }
+
+    // see FieldRenderer::setAntialiasing()
+    void setAntialiasing(bool enable) {
+        antialiasing_ = enable;
+    }
+
+    void run() {
+        QTextStream out(stdout);
+
+        int bytesPerLine = Renderer::compatibleBytesPerLine(size_.width());
+
+        out << "scaling " << size_.width() << "x" << size_.height() << ", "
+            << frames_ << " frames per thread count"
+            << (antialiasing_ ? ", antialiased" : "") << ", "
+            << NumaTopology::instance().nodeCount() << " numa nodes" << '\n';
+
+        double reference = 0.0;
+        for (int threads = 1; threads <= maxThreads_; threads++) {
+            FieldRenderer<F> renderer(field_, threads);
+            renderer.setAntialiasing(antialiasing_);
+            FrameMemory bits(bytesPerLine * size_.height());
+
+            // first frame pays for the rays
+            renderer.render(bits.data(), size_, bytesPerLine);
+            renderer.resetStats();
+
+            for (int frame = 0; frame < frames_; frame++) {
+                renderer.render(bits.data(), size_, bytesPerLine);
+            }
+
+            double frameMs = renderer.elapsedNs() / 1e6 / renderer.frames();
+            if (threads == 1) {
+                reference = frameMs;
+            }
+            double speedup = reference / frameMs;
+            double efficiency = speedup / threads;
+
+            const std::vector<typename FieldRenderer<F>::ThreadStats> &stats = renderer.threadStats();
+            qint64 busyMax = 0, busyTotal = 0;
+            for (const auto &s : stats) {
+                busyMax = qMax(busyMax, s.busyNs);
+                busyTotal += s.busyNs;
+            }
+            double imbalance = busyTotal ? (double) busyMax * threads / busyTotal : 1.0;
+            double prepareMs = renderer.prepareNs() / 1e6 / renderer.frames();
+
+            out << QString("threads %1: %2 ms/frame (prepare %3), speedup %4, efficiency %5%, imbalance %6%7")
+                   .arg(threads)
+                   .arg(frameMs, 0, 'f', 2)
+                   .arg(prepareMs, 0, 'f', 2)
+                   .arg(speedup, 0, 'f', 2)
+                   .arg(efficiency * 100.0, 0, 'f', 1)
+                   .arg(imbalance, 0, 'f', 2)
+                   .arg(imbalance > ImbalanceThreshold ? " IMBALANCED" : "")
+                << '\n';
+
+            for (int i = 0; i < (int) stats.size(); i++) {
+                const auto &s = stats[i];
+                out << QString("    worker %1: %2 lines/frame, busy %3 ms/frame, idle at barrier %4 ms/frame")
+                       .arg(i)
+                       .arg((double) s.lines / renderer.frames(), 0, 'f', 1)
+                       .arg(s.busyNs / 1e6 / renderer.frames(), 0, 'f', 2)
+                       .arg(s.idleNs / 1e6 / renderer.frames(), 0, 'f', 2)
+                    << '\n';
+            }
+        }
+        out.flush();
+    }
+
+private:
+    const F &field_;
+    QSize size_;
+    int maxThreads_;
+    int frames_;
+    bool antialiasing_;
+};
+
+// Renders the same scene from viewCount cameras of different frustums and sizes,
+// first with one FieldRenderer per view as separate widgets would, then with a single
+// FieldRenderer drawing all views in one render() call, and prints the frame time of both.
+// Each setup gets its own views and frame buffers so that its pages are first touched
+// by its own workers, see FrameMemory.
+template <class F>
+class MultiViewReport {
+public:
+    MultiViewReport(const F &field, const QSize &size, int viewCount, int frames) :
+        field_(field),
+        size_(size),
+        viewCount_(viewCount),
+        frames_(frames) {
+    }
+
+    void run() {
+        QTextStream out(stdout);
+
+        out << "multiview " << viewCount_ << " views up to " << size_.width() << "x" << size_.height()
+            << ", " << frames_ << " frames" << '\n';
+
+        double independentMs;
+        {
+            Views views(size_, viewCount_);
+            std::vector<std::unique_ptr<FieldRenderer<F>>> renderers;
+            for (int v = 0; v < viewCount_; v++) {
+                renderers.emplace_back(new FieldRenderer<F>(field_));
+            }
+
+            // first frame pays for the rays
+            for (int v = 0; v < viewCount_; v++) {
+                renderers[v]->render(QVector<RenderView *>() << views.list[v]);
+                renderers[v]->resetStats();
+            }
+
+            qint64 elapsed = 0;
+            for (int frame = 0; frame < frames_; frame++) {
+                for (int v = 0; v < viewCount_; v++) {
+                    renderers[v]->render(QVector<RenderView *>() << views.list[v]);
+                }
+            }
+            for (int v = 0; v < viewCount_; v++) {
+                elapsed += renderers[v]->elapsedNs();
+            }
+            independentMs = elapsed / 1e6 / frames_;
+        }
+
+        double batchedMs;
+        {
+            Views views(size_, viewCount_);
+            FieldRenderer<F> renderer(field_);
+            renderer.render(views.list);
+            renderer.resetStats();
+
+            for (int frame = 0; frame < frames_; frame++) {
+                renderer.render(views.list);
+            }
+            batchedMs = renderer.elapsedNs() / 1e6 / frames_;
+        }
+
+        out << QString("one renderer per view: %1 ms/frame, one batched renderer: %2 ms/frame, speedup %3")
+               .arg(independentMs, 0, 'f', 2)
+               .arg(batchedMs, 0, 'f', 2)
+               .arg(independentMs / batchedMs, 0, 'f', 2)
+            << '\n';
+        out.flush();
+    }
+
+private:
+    const F &field_;
+    QSize size_;
+    int viewCount_;
+    int frames_;
+
+    // the views and their frame buffers
+    // view v is 1, 3/4 or 1/2 of the requested size, zoomed in a bit more each time
+    struct Views {
+        QVector<RenderView *> list;
+        std::vector<std::unique_ptr<RenderView>> owner;
+        std::vector<std::unique_ptr<FrameMemory>> buffers;
+
+        Views(const QSize &maxSize, int count) {
+            for (int v = 0; v < count; v++) {
+                int scale = 4 - v % 3;
+                QSize size(maxSize.width() * scale / 4, maxSize.height() * scale / 4);
+                int bytesPerLine = Renderer::compatibleBytesPerLine(size.width());
+                float zoom = scale / 4.0f * (1.0f + 0.1f * v);
+
+                owner.emplace_back(new RenderView);
+                buffers.emplace_back(new FrameMemory(bytesPerLine * size.height()));
+                owner.back()->setFrustum(2.0, 50.0 * zoom, -2.0, 37.5 * zoom);
+                owner.back()->setTarget(buffers.back()->data(), size, bytesPerLine);
+                list << owner.back().get();
+            }
+        }
+    };
+};
+
+#endif // SCALINGREPORT_H
@@ -0,0 +1,193 @@
+#ifndef SHAREDFRAMES_H
+#define SHAREDFRAMES_H
+#include <QDebug>
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "framememory.h"
+#include "renderer.h"
+#include "tracer.h"
+
+// A ring of frames living in a POSIX shared memory object or in a mmap'd file,
+// so that FieldRenderer::render() can write straight into memory that another
+// process (an encoder for instance) maps as well. Nothing is ever copied.
+//
+// Layout of the mapping:
+//   [Header][padding up to dataOffset][slot 0][slot 1]...[slot slotCount - 1]
+// Every slot starts on a page boundary and holds height lines of bytesPerLine bytes,
+// which satisfies Renderer::FrameAlignment and Renderer::compatibleBytesPerLine().
+// Pixels are QImage::Format_ARGB32, pixelOrder spells their bytes in memory order
+// ("BGRA" on little endian machines) for consumers that don't know Qt formats.
+//
+// Consumer side: load frameCounter with acquire semantics, frame n (counting from 0)
+// lives in slot n % slotCount. The producer only ever writes into slot
+// frameCounter % slotCount, so a consumer reading frame frameCounter - 1 has
+// slotCount - 1 frames worth of time before it is overwritten. Reload frameCounter
+// once done copying/encoding to check it did not fall behind.
+class SharedFrameRing {
+public:
+    enum Backing {
+        SharedMemory,   // name is a shm_open() name like "/metaballs"
+        MappedFile      // name is a path on the filesystem
+    };
+
+    struct Header {
+        quint32 magic;          // Magic
+        quint32 version;        // Version
+        quint32 width;
+        quint32 height;
+        quint32 bytesPerLine;
+        quint32 slotCount;
+        char pixelOrder[4];     // channels of a pixel in memory order, "BGRA" or "ARGB"
+        quint32 imageFormat;    // QImage::Format of the slots
+        quint64 slotBytes;      // size of a slot, multiple of the page size
+        quint64 dataOffset;     // offset of slot 0 from the start of the mapping
+        quint64 frameCounter;   // number of published frames, only accessed atomically
+    };
+
+    static constexpr quint32 Magic = 0x5246424d;   // "MBFR" in memory
+    static constexpr quint32 Version = 2;
+
+    SharedFrameRing(const QString &name, Backing backing, const QSize &size, int slotCount) :
+        name_(name),
+        backing_(backing),
+        size_(size),
+        slotCount_(slotCount),
+        fd_(-1),
+        mapping_(nullptr),
+        mappingSize_(0),
+        header_(nullptr) {
+        if (size.isEmpty() || slotCount < 2) {
+            errorString_ = "invalid frame size or slot count";
+            return;
+        }
+
+        size_t page = sysconf(_SC_PAGESIZE);
+        bytesPerLine_ = Renderer::compatibleBytesPerLine(size.width());
+        slotBytes_ = FrameMemory::roundUp((size_t) bytesPerLine_ * size.height(), page);
+        dataOffset_ = FrameMemory::roundUp(sizeof(Header), page);
+        mappingSize_ = dataOffset_ + slotBytes_ * slotCount;
+
+        QByteArray path = name.toLocal8Bit();
+        if (backing == SharedMemory) {
+            fd_ = shm_open(path.constData(), O_RDWR | O_CREAT, 0644);
+        }
+        else {
+            fd_ = open(path.constData(), O_RDWR | O_CREAT, 0644);
+        }
+        if (fd_ == -1) {
+            setError("open");
+            return;
+        }
+
+        if (ftruncate(fd_, mappingSize_) == -1) {
+            setError("ftruncate");
+            return;
+        }
+
+        void *mapping = mmap(nullptr, mappingSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (mapping == MAP_FAILED) {
+            setError("mmap");
+            return;
+        }
+        mapping_ = static_cast<uchar *>(mapping);
+
+        // publish the header last, magic included, so that a consumer polling the
+        // mapping never sees a half written one
+        header_ = reinterpret_cast<Header *>(mapping_);
+        __atomic_store_n(&header_->magic, 0, __ATOMIC_RELAXED);
+        header_->version = Version;
+        header_->width = size.width();
+        header_->height = size.height();
+        header_->bytesPerLine = bytesPerLine_;
+        header_->slotCount = slotCount;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        memcpy(header_->pixelOrder, "BGRA", 4);
+#else
+        memcpy(header_->pixelOrder, "ARGB", 4);
+#endif
+        header_->imageFormat = QImage::Format_ARGB32;
+        header_->slotBytes = slotBytes_;
+        header_->dataOffset = dataOffset_;
+        __atomic_store_n(&header_->frameCounter, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&header_->magic, Magic, __ATOMIC_RELEASE);
+
+        qDebug() << __func__ << name << slotCount << "slots of" << slotBytes_ << "bytes";
+    }
+
+    ~SharedFrameRing() {
+        if (mapping_) {
+            munmap(mapping_, mappingSize_);
+        }
+        if (fd_ != -1) {
+            close(fd_);
+        }
+        if (backing_ == SharedMemory && fd_ != -1) {
+            shm_unlink(name_.toLocal8Bit().constData());
+        }
+    }
+
+    bool isValid() const {
+        return header_ != nullptr;
+    }
+
+    QString errorString() const {
+        return errorString_;
+    }
+
+    QSize size() const {
+        return size_;
+    }
+
+    int bytesPerLine() const {
+        return bytesPerLine_;
+    }
+
+    // slot the next frame has to be rendered into
+    uchar *beginFrame() {
+        quint64 frame = __atomic_load_n(&header_->frameCounter, __ATOMIC_RELAXED);
+        return mapping_ + dataOffset_ + (frame % slotCount_) * slotBytes_;
+    }
+
+    // make the frame written since beginFrame() visible to consumers
+    void endFrame() {
+        TRACE_SCOPE("present");
+        __atomic_fetch_add(&header_->frameCounter, 1, __ATOMIC_RELEASE);
+    }
+
+    // render one frame into the ring and publish it
+    void render(Renderer &renderer) {
+        renderer.render(beginFrame(), size_, bytesPerLine_);
+        endFrame();
+    }
+
+private:
+    QString name_;
+    Backing backing_;
+    QSize size_;
+    int slotCount_;
+    int bytesPerLine_;
+    size_t slotBytes_;
+    size_t dataOffset_;
+
+    int fd_;
+    uchar *mapping_;
+    size_t mappingSize_;
+    Header *header_;
+    QString errorString_;
+
+    void setError(const char *what) {
+        errorString_ = QString("%1: %2").arg(what).arg(strerror(errno));
+        qWarning() << __func__ << name_ << errorString_;
+    }
+};
+
+#endif // SHAREDFRAMES_H
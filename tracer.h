@@ -0,0 +1,186 @@
+#ifndef TRACER_H
+#define TRACER_H
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QString>
+#include <QTextStream>
+
+#include <vector>
+
+#include <x86intrin.h>
+
+// Scoped span tracer exporting Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+//
+// Spans are stamped with the TSC and appended to a ring buffer owned by the calling
+// thread, so recording takes no lock and touches no shared cache line. A thread's
+// buffer is registered (under a mutex) the first time it records, and grows by
+// chunks of ChunkSize spans up to Capacity, so that the many short lived worker
+// pools of a benchmark only cost the spans they record. When a ring is full the
+// oldest spans are overwritten.
+//
+// Tracing is off by default, a disabled TRACE_SCOPE costs one relaxed load.
+// Export once the traced threads are idle, e.g. when the app quits.
+class Tracer {
+public:
+    static constexpr int Capacity = 1 << 16;   // spans per thread
+    static constexpr int ChunkSize = 1 << 10;  // spans allocated at once, divides Capacity
+
+    static Tracer &instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    static inline bool isEnabled() {
+        return __atomic_load_n(&enabled(), __ATOMIC_RELAXED);
+    }
+
+    static void setEnabled(bool enable) {
+        instance();     // starts the TSC calibration
+        __atomic_store_n(&enabled(), enable, __ATOMIC_RELAXED);
+    }
+
+    static inline quint64 now() {
+        return __rdtsc();
+    }
+
+    // name shown for the calling thread in the trace
+    void setThreadName(const QString &name) {
+        if (isEnabled()) {
+            localBuffer()->name = name;
+        }
+    }
+
+    // name must be a string literal or otherwise outlive the tracer, arg < 0 means none
+    inline void record(const char *name, quint64 begin, quint64 end, int arg = -1) {
+        ThreadBuffer *buffer = localBuffer();
+        int index = buffer->head % Capacity;
+        if (index / ChunkSize == (int) buffer->chunks.size()) {
+            buffer->chunks.push_back(new Span[ChunkSize]);
+        }
+        Span &span = buffer->span(index);
+        span.name = name;
+        span.begin = begin;
+        span.end = end;
+        span.arg = arg;
+        __atomic_store_n(&buffer->head, buffer->head + 1, __ATOMIC_RELEASE);
+    }
+
+    bool exportChromeTrace(const QString &path) {
+        QFile file(path);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+            qWarning() << __func__ << path << file.errorString();
+            return false;
+        }
+
+        // calibrate the TSC against the monotonic clock over the tracer lifetime
+        double ticksPerUs = (double) (now() - originTicks_) / (origin_.nsecsElapsed() / 1000.0);
+
+        QTextStream out(&file);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+
+        QMutexLocker locker(&mutex_);
+        for (size_t t = 0; t < buffers_.size(); t++) {
+            ThreadBuffer *buffer = buffers_[t];
+            quint64 head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+            quint64 tail = head > (quint64) Capacity ? head - Capacity : 0;
+
+            out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t
+                << ",\"args\":{\"name\":\"" << buffer->name << "\"}}";
+            first = false;
+
+            for (quint64 i = tail; i < head; i++) {
+                const Span &span = buffer->span(i % Capacity);
+                out << ",\n{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << t
+                    << ",\"ts\":" << QString::number((span.begin - originTicks_) / ticksPerUs, 'f', 3)
+                    << ",\"dur\":" << QString::number((span.end - span.begin) / ticksPerUs, 'f', 3);
+                if (span.arg >= 0) {
+                    out << ",\"args\":{\"n\":" << span.arg << "}";
+                }
+                out << "}";
+            }
+        }
+        out << "\n]}\n";
+
+        qDebug() << __func__ << path << buffers_.size() << "threads";
+        return true;
+    }
+
+private:
+    struct Span {
+        const char *name;
+        quint64 begin;
+        quint64 end;
+        int arg;
+    };
+
+    struct ThreadBuffer {
+        QString name;
+        quint64 head;                   // spans ever recorded, only written by the owning thread
+        std::vector<Span *> chunks;     // ChunkSize spans each, only grown by the owning thread
+
+        Span &span(int index) {
+            return chunks[index / ChunkSize][index % ChunkSize];
+        }
+    };
+
+    QMutex mutex_;
+    std::vector<ThreadBuffer *> buffers_;   // never freed, threads may exit before export
+    QElapsedTimer origin_;
+    quint64 originTicks_;
+
+    Tracer() {
+        origin_.start();
+        originTicks_ = now();
+    }
+
+    static bool &enabled() {
+        static bool enabled = false;
+        return enabled;
+    }
+
+    ThreadBuffer *localBuffer() {
+        static thread_local ThreadBuffer *buffer = nullptr;
+        if (buffer == nullptr) {
+            buffer = new ThreadBuffer;
+            buffer->head = 0;
+
+            QMutexLocker locker(&mutex_);
+            buffer->name = QString("thread %1").arg((int) buffers_.size());
+            buffers_.push_back(buffer);
+        }
+        return buffer;
+    }
+};
+
+// records the lifetime of the object as a span
+class TraceSpan {
+public:
+    inline TraceSpan(const char *name, int arg = -1) : name_(name), arg_(arg), begin_(0) {
+        if (Tracer::isEnabled()) {
+            begin_ = Tracer::now();
+        }
+    }
+
+    inline ~TraceSpan() {
+        if (begin_) {
+            Tracer::instance().record(name_, begin_, Tracer::now(), arg_);
+        }
+    }
+
+private:
+    const char *name_;
+    int arg_;
+    quint64 begin_;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+
+// TRACE_SCOPE("name") or TRACE_SCOPE("name", number)
+#define TRACE_SCOPE(...) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(__VA_ARGS__)
+
+#endif // TRACER_H